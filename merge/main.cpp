@@ -0,0 +1,188 @@
+﻿#include "merge.h"
+
+#include <exception>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#ifdef _WIN32
+#include <conio.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// --- 命令行程序: 解析参数后调用 libmerge ---
+
+void printUsage(const char *programName) {
+  std::cerr << "用法 1 (单目录): " << programName << " [选项] <目录路径>" << std::endl;
+  std::cerr << "  -> 扫描单个目录，并在其父目录下生成'目录名_merge.xml'。\n" << std::endl;
+  std::cerr << "用法 2 (多目录): " << programName << " [选项] <目录1> <目录2> ... <输出文件.xml>" << std::endl;
+  std::cerr << "  -> 扫描多个目录，并将所有结果合并到指定的输出文件中。" << std::endl;
+  std::cerr << "  -> 目录参数也可以是 .zip / .tar / .tar.gz / .tgz 压缩包，直接读取，无需解压。\n" << std::endl;
+  std::cerr << "用法 3 (引用文件): " << programName << " [选项] <引用文件路径>" << std::endl;
+  std::cerr << "  -> 读取引用文件中列出的文件路径进行合并。\n" << std::endl;
+  std::cerr << "选项:" << std::endl;
+  std::cerr << "  --stream-threshold <大小>  超过该大小的文件分块流式写入 (默认 64M，支持 k/m/g 后缀)" << std::endl;
+  std::cerr << "  --output-mode <模式>       输出写入方式: buffered (默认) / direct (O_DIRECT) / mmap" << std::endl;
+  std::cerr << "  --read-backend <方式>      读取文件内容的方式: auto (默认，Linux 上内核支持时用 io_uring) / pool (线程池)" << std::endl;
+  std::cerr << "  --output-size-hint <大小>  预计输出大小，用于预先分配输出文件空间" << std::endl;
+  std::cerr << "  --git-index                 从 .git/index 读取已跟踪文件列表，不遍历目录、不应用忽略规则" << std::endl;
+  std::cerr << "  --follow-symlinks           跟随符号链接并检测循环；同一物理文件/目录 (dev, inode) 只读取一次，其余位置输出 same_as 引用" << std::endl;
+  std::cerr << "  --hash                      为每个 <file> 加上内容的 XXH3-64 哈希 (hash=\"xxh3:...\"，与 xxhsum -H3 一致)，读取时同步计算" << std::endl;
+  std::cerr << "  --minify                    去掉注释、行尾空白和空行 (C/C++/Java/Kotlin/C#/Dart/Gradle/Go/Rust/JS/TS/Python/YAML/properties)，保留字符串，按语言统计节省的字节和 token；与 --hash 同用时为精简后内容的哈希" << std::endl;
+  std::cerr << "  --outline                   只输出声明大纲：导入、类型、类成员和函数签名，函数体折叠为 { ... } (Python 为 ...)，按语言并行扫描 (C/C++/Java/Kotlin/C#/Dart/Go/Rust/JS/TS/Python)；其余文件照常输出" << std::endl;
+  std::cerr << "  --redact                    写出前替换密钥为 [REDACTED:规则名]: AWS/GitHub/GitLab/Slack/Stripe/Google/npm 等令牌、JWT、私钥块，以及 password/secret/token 等键名后的高熵值；流式写入的文件同样处理，每个文件的替换数写入日志" << std::endl;
+  std::cerr << "  --tree                      每个 <project> 开头输出目录树摘要 <tree>：各目录 (含子目录) 合并的文件数、字节数和估算 token 数，遍历时累加，正文经临时缓冲后接在其后" << std::endl;
+  std::cerr << "  --checkpoint                定期 (默认每 10 秒，在一个文件写完后) 把遍历位置、已刷到磁盘的输出长度和计数记录到 <输出>.checkpoint；按目录扫描模式，根目录逐个处理" << std::endl;
+  std::cerr << "  --checkpoint-interval <秒>  检查点间隔 (0 为每个文件之后)，隐含 --checkpoint" << std::endl;
+  std::cerr << "  --resume                    从检查点续传：输出截断到检查点，跳过已完成的根目录和已写出的文件 (不重新读取) 后接着合并；输入和选项须与中断时相同" << std::endl;
+  std::cerr << "  --filter <表达式>         只合并表达式选中的文件，如 \"size < 200k && ext in {cpp,h} && path !~ test/ && mtime > 7d\"；字段 size/lines/mtime/ext/name/path/content，运算符 < <= > >= == != in !in ~ (正则) !~，&& || ! 和括号组合；路径、大小和修改时间在遍历时判定，不匹配的子目录不进入、文件不读取；引用文件中的 \"@filter <表达式>\" 行作用于其后的文件" << std::endl;
+  std::cerr << "  --report <文件.json>       另把结束时的统计信息写成 JSON：文件数、按语言的文件数/行数/非空行数/字节数 (合并时同步统计)、节省量和耗时" << std::endl;
+  std::cerr << "  --progress                  先只读元数据预扫描 (预计输出大小并预分配)，合并时每秒显示进度、吞吐量和预计剩余时间 (按目录扫描模式)" << std::endl;
+  std::cerr << "  --rev <修订版本>          直接从 git 对象库合并指定提交/分支/标签的文件 (如 HEAD~2, v1.0)，无需检出" << std::endl;
+  std::cerr << "  --diff <旧的合并文件>     与上次的合并结果比较，另写出只含新增/删除/修改文件的 *_delta.xml (修改的文件为统一格式差异)" << std::endl;
+  std::cerr << "  --entry <文件>            只合并入口文件及其直接或间接引用的文件 (#include / import / require / Go import / Rust mod)，在输入目录内解析，按依赖顺序输出为平铺文件列表" << std::endl;
+  std::cerr << "  --query <文本>            只合并与查询最相关的文件 (按标识符分词，BM25 排序)" << std::endl;
+  std::cerr << "  --budget <大小>            与 --query 一起使用: 输出字节预算 (支持 k/m/g 后缀)" << std::endl;
+  std::cerr << "  --token-budget <数量>      与 --query 一起使用: 输出 token 预算 (按 4 字节/token 估算)" << std::endl;
+  std::cerr << "  --near-dup <方式>          近似重复文件 (MinHash): collapse 折叠为参考文件+差异 / skip 跳过" << std::endl;
+  std::cerr << "  --near-dup-threshold <值>  近似重复的相似度阈值 (0-1，默认 0.9)" << std::endl;
+  std::cerr << "  --max-file-bytes <大小>    超过该大小的文件只输出首尾各 N 行，中间以省略标记代替 (不读取中间部分)" << std::endl;
+  std::cerr << "  --max-file-lines <行数>    超过该行数的文件只输出首尾各 N 行" << std::endl;
+  std::cerr << "  --excerpt-lines <行数>     截取时首尾各保留的行数 (默认 50)" << std::endl;
+  std::cerr << "  --root-jobs <数量>          同时处理的根目录数 (默认或 0 为按 CPU 核数，4 到 8 个；1 为逐个处理)" << std::endl;
+  std::cerr << "  --root-buffer <大小>       并发处理时各根目录待输出内容的内存总上限 (默认 256M)，超出部分写入临时文件" << std::endl;
+  std::cerr << "  --batch <清单.json>         批处理: 按清单文件执行多个合并作业 (输入、输出、选项)，共享文件内容和目录列表缓存，结束时不等待按键" << std::endl;
+  std::cerr << "  --batch-jobs <数量>         批处理时同时执行的作业数 (默认 4)" << std::endl;
+  std::cerr << "  --batch-cache <大小>        批处理共享缓存的内存上限 (默认 512M)" << std::endl;
+  std::cerr << "  --no-pause                  结束时不等待按键 (Windows)" << std::endl;
+  std::cerr << "  --bench-output <文件>      对比 std::ofstream 与各输出模式的写入速度后退出" << std::endl;
+}
+
+// --- 主函数 (modified for multi-directory support) ---
+int main(int argc, char *argv[]) {
+  MergeOptions options;
+  std::vector<std::string> args; // args[0] 为程序名，其余为位置参数
+  std::string optionError;
+  if (!parseCommandLine(argc, argv, options, args, optionError)) {
+    std::cerr << "错误: " << optionError << "\n" << std::endl;
+    printUsage(argv[0]);
+    return 1;
+  }
+  int argCount = static_cast<int>(args.size());
+  if (!options.benchOutputFile.empty()) {
+    return runOutputBenchmark(fs::absolute(options.benchOutputFile));
+  }
+  if (!options.batchManifest.empty()) {
+    if (argCount > 1) {
+      std::cerr << "错误: --batch 不能与输入路径同时使用\n" << std::endl;
+      printUsage(argv[0]);
+      return 1;
+    }
+    return runBatch(fs::absolute(options.batchManifest).lexically_normal(), options);
+  }
+
+  fs::path inputPath;
+  int result = 1;
+  std::error_code ec;
+
+  if (argCount == 1) {
+    std::string dirInput;
+    std::cout << "请输入要扫描的目录路径: ";
+    std::getline(std::cin, dirInput);
+    if (dirInput.empty()) {
+      std::cerr << "未输入任何路径，程序退出。" << std::endl;
+      return 1;
+    }
+    try {
+      inputPath = fs::absolute(dirInput).lexically_normal();
+      // 兼容模式：单目录扫描，使用旧的输出文件命名规则
+      std::vector<fs::path> inputDirs = {inputPath};
+      fs::path outputFile = inputPath.parent_path() /
+                            (archiveExtractRoot(inputPath).filename().string() + "_merge.xml");
+      result = mergeByDir(inputDirs, outputFile, options);
+    } catch (const std::exception &e) {
+      std::cerr << "错误: 处理输入路径时出错: " << e.what() << std::endl;
+      return 1;
+    }
+  } else if (argCount >= 2) { // 修改为处理所有 argCount >= 2 的情况
+    // 首先判断是否是按引用文件模式（因为它的格式是固定的：一个文件输入）
+    fs::path firstArgPath = args[1];
+    std::error_code ec;
+    bool is_file = fs::is_regular_file(fs::absolute(firstArgPath), ec);
+
+    // 如果只有一个参数，且它是一个文件 (压缩包除外)，则认为是引用文件模式
+    if (argCount == 2 && !ec && is_file && archiveKindOf(firstArgPath) == ArchiveKind::None) {
+      result = mergeByRef(fs::absolute(firstArgPath).lexically_normal(), options);
+    }
+      // 否则，全部当作目录扫描模式处理
+    else {
+      std::vector<fs::path> inputDirs;
+      fs::path outputFile;
+
+      if (argCount == 2) { // 兼容旧的单目录模式
+        fs::path rootPath = fs::absolute(args[1]).lexically_normal();
+        if (!fs::is_directory(rootPath, ec) && archiveKindOf(rootPath) == ArchiveKind::None) {
+          std::cerr << "错误: 输入路径 '" << rootPath.string() << "' 不是一个有效的目录。" << std::endl;
+          return 1;
+        }
+        inputDirs.push_back(rootPath);
+        // 沿用旧的输出文件命名规则 (压缩包按解压后的目录名命名)
+        outputFile = rootPath.parent_path() /
+                     (archiveExtractRoot(rootPath).filename().string() + "_merge.xml");
+
+      } else { // argCount >= 3, 新的多目录模式
+        // 最后一个参数是输出文件
+        outputFile = fs::absolute(args[argCount - 1]).lexically_normal();
+
+        // 检查输出文件的父目录是否存在
+        fs::path outputParentPath = outputFile.parent_path();
+        if (!outputParentPath.empty() && !fs::exists(outputParentPath)) {
+          std::cerr << "错误: 输出目录 '" << outputParentPath.string() << "' 不存在。" << std::endl;
+          return 1;
+        }
+
+        // 其余参数是输入目录
+        for (int i = 1; i < argCount - 1; ++i) {
+          fs::path dirPath = fs::absolute(args[i]).lexically_normal();
+          if (!fs::is_directory(dirPath, ec) && archiveKindOf(dirPath) == ArchiveKind::None) {
+            std::cerr << "错误: 输入路径 '" << dirPath.string() << "' 不是一个有效的目录或压缩包。所有输入都必须是目录或压缩包。" << std::endl;
+            return 1;
+          }
+          inputDirs.push_back(dirPath);
+        }
+      }
+
+      // 统一调用新的 mergeByDir 函数
+      result = mergeByDir(inputDirs, outputFile, options);
+    }
+  }
+
+#ifdef _WIN32
+  if (options.noPause) {
+    std::cout << "\n处理结束 (" << (result == 0 ? "成功" : "失败") << ")" << std::endl;
+    return result;
+  }
+  std::cout << "\n处理结束 (" << (result == 0 ? "成功" : "失败")
+            << ")，按任意键退出..." << std::endl;
+  while (_kbhit())
+    _getch(); // Clear buffer
+  _getch();   // Wait for key press
+#else
+  std::cout << "\n处理结束 (" << (result == 0 ? "成功" : "失败") << ")" << std::endl;
+#endif
+  return result;
+}
+
+/*
+D:/workspace/c/windows-tools/cmake-build-release/merge.exe ^
+D:\workspace\hitravel\lcdp-mgr\lcdp-web ^
+D:\workspace\hitravel\lcdp-mgr\lcdp-openapi ^
+D:\workspace\hitravel\lcdp-mgr\lcdp-user-center ^
+D:\workspace\hitravel\lcdp-mgr\lcdp-starter-test ^
+./lcdp.xml
+
+pause
+
+ * */
\ No newline at end of file
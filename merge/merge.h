@@ -0,0 +1,324 @@
+// --- merge 合并引擎 (libmerge) 公共接口 ---
+// 命令行程序 merge 只是这里的一层包装。其他程序 (如 MCP 服务) 可以直接链接 libmerge：
+// mergeByDir / mergeByRef 写出与命令行相同的 XML；mergeToSink 不生成 XML，把每个
+// 合并的文件 (路径、内容、元数据) 按输出顺序交给调用方实现的 MergeSink。
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// How OutputSink gets bytes to disk. Direct and Mmap fall back to Buffered
+// where the platform or filesystem does not support them.
+enum class OutputMode { Buffered, Direct, Mmap };
+
+// How directory walks read file contents: Auto uses io_uring where the
+// kernel supports it and the thread pool otherwise; Pool always uses the
+// thread pool (to compare the two).
+enum class ReadBackend { Auto, Pool };
+
+// What to do with files that are near-duplicates of an earlier file.
+enum class NearDupMode { Off, Collapse, Skip };
+
+class FileFilter;
+
+// --- 运行选项 (由命令行参数或调用方填充) ---
+
+struct MergeOptions {
+  // Files larger than this many bytes are streamed through the emitter in
+  // fixed-size chunks instead of being loaded whole (0 streams every file).
+  uint64_t streamThreshold = 64ull << 20;
+  OutputMode outputMode = OutputMode::Buffered;
+  ReadBackend readBackend = ReadBackend::Auto;
+  // Enumerate files from .git/index instead of walking the directory tree.
+  bool useGitIndex = false;
+  // Merge the tree of this revision (commit, branch, tag, ~N/^N) straight
+  // from the object store instead of the work tree; empty merges the files
+  // on disk.
+  std::string rev;
+  // When set, only run the output writer benchmark against this scratch file.
+  std::string benchOutputFile;
+  // Expected output size; the output file is preallocated up to it (0: grow
+  // the preallocation as output is written).
+  uint64_t outputSizeHint = 0;
+  // Only merge this file and the files it reaches through #include, import,
+  // require or mod references resolved within the roots (directories only),
+  // written as a flat list with each file after those it references.
+  std::filesystem::path entry;
+  // Only merge the files most relevant to this query (BM25), within the
+  // budgets below (0: no limit).
+  std::string query;
+  uint64_t budgetBytes = 0;
+  uint64_t budgetTokens = 0;
+  // Collapse (reference + diff) or skip files that are near-duplicates of an
+  // earlier one, at this estimated line-set similarity or above.
+  NearDupMode nearDupMode = NearDupMode::Off;
+  double nearDupThreshold = 0.9;
+  // Roots processed at once by mergeByDir (0: one per core, at least 4 and at
+  // most 8), and the memory their pending output may use before spilling to
+  // temporary files.
+  unsigned rootJobs = 0;
+  uint64_t rootBufferMemory = 256ull << 20;
+  // Follow symbolic links in directory walks with cycle detection; a file or
+  // directory reached again (same device and inode, e.g. through a link or a
+  // hard link) is emitted as a same_as reference instead of being re-read.
+  bool followSymlinks = false;
+  // Earlier merge output to compare with: the new output is written as usual
+  // and the added / removed / modified files also to <output>_delta.xml.
+  std::filesystem::path diffBase;
+  // Files above either limit are cut to their first and last excerptLines
+  // lines with an elision marker in between (0: no limit).
+  uint64_t maxFileBytes = 0;
+  uint64_t maxFileLines = 0;
+  uint64_t excerptLines = 50;
+  // Add a hash="xxh3:<hex>" attribute with the XXH3-64 hash of each file's
+  // content (as read, without BOM) to its <file> element.
+  bool hashContent = false;
+  // Pre-scan the roots (metadata only) to predict the output size and
+  // preallocate it, and report progress with percentage and ETA while merging.
+  bool showProgress = false;
+  // Drop comments, trailing whitespace and blank lines from C/C++, Java,
+  // Kotlin, C#, Dart, Go, Rust, JS/TS, Python, YAML and properties files,
+  // keeping literals intact (not for streamed or excerpted files; --hash
+  // then hashes the minified content).
+  bool minify = false;
+  // Keep only declarations (imports, types, class members, signatures) of
+  // the languages of minify except YAML, properties and Gradle, folding
+  // function bodies; the files are outlined in parallel as they are read
+  // (not streamed or excerpted files).
+  bool outline = false;
+  // Replace API keys, tokens, private keys and high-entropy values assigned
+  // to password / secret / token names with [REDACTED:<rule>] as files are
+  // written, streamed files included (--hash then hashes the redacted
+  // content).
+  bool redact = false;
+  // Start each <project> with a <tree> of its directories with the files,
+  // bytes and estimated tokens merged in each (subdirectories included).
+  bool treeSummary = false;
+  // Record a checkpoint (traversal position, output length, counters) next
+  // to the output every checkpointInterval seconds (0: after every file);
+  // resume records from the last one, reusing the output written up to it.
+  // Directory mode only; roots are then merged one after another.
+  bool checkpoints = false;
+  uint64_t checkpointInterval = 10;
+  bool resume = false;
+  // Only merge the files this compiled --filter expression selects, among
+  // those merged otherwise; conditions on paths, sizes and modification
+  // times are decided during the walk, before anything is read.
+  std::shared_ptr<const FileFilter> filter;
+  // Also write the statistics printed at the end (files, lines and bytes by
+  // language, savings, timing) to this file as JSON.
+  std::filesystem::path reportFile;
+  // Run the merge jobs listed in this manifest (JSON) instead of one merge,
+  // at most batchJobs at once (0: up to 4), sharing caches of file contents
+  // and directory listings of up to batchCacheMemory bytes.
+  std::string batchManifest;
+  unsigned batchJobs = 0;
+  uint64_t batchCacheMemory = 512ull << 20;
+  // Do not wait for a key press before exiting (Windows).
+  bool noPause = false;
+};
+
+// Files and bytes before and after --minify or --outline, for one language.
+struct ReductionCounts {
+  uint64_t files = 0;
+  uint64_t bytesIn = 0;
+  uint64_t bytesOut = 0;
+
+  uint64_t saved() const { return bytesIn - bytesOut; }
+  ReductionCounts &operator+=(const ReductionCounts &other) {
+    files += other.files;
+    bytesIn += other.bytesIn;
+    bytesOut += other.bytesOut;
+    return *this;
+  }
+};
+
+// Files, lines (those with more than blanks too) and bytes of the merged
+// content of one language, as written (after --minify, --outline, excerpts
+// and --redact).
+struct CodeMetrics {
+  uint64_t files = 0;
+  uint64_t lines = 0;
+  uint64_t nonBlankLines = 0;
+  uint64_t bytes = 0;
+
+  uint64_t blankLines() const { return lines - nonBlankLines; }
+  CodeMetrics &operator+=(const CodeMetrics &other) {
+    files += other.files;
+    lines += other.lines;
+    nonBlankLines += other.nonBlankLines;
+    bytes += other.bytes;
+    return *this;
+  }
+};
+
+// Counters and cost of one root, or of a whole merge.
+struct MergeStats {
+  int mergedFiles = 0;
+  int skippedFilesNonCode = 0;
+  int skippedFilesIgnored = 0;
+  int skippedDirs = 0;
+  int sameAsFiles = 0; // --follow-symlinks references
+  int sameAsDirs = 0;
+  int symlinkCycles = 0;
+  int filteredFiles = 0; // excluded by --filter
+  int filteredDirs = 0;
+  uint64_t outputBytes = 0;
+  std::chrono::steady_clock::duration elapsed{};
+  std::map<std::string, CodeMetrics> languages;    // by language
+  std::map<std::string, ReductionCounts> minified; // by language
+  std::map<std::string, ReductionCounts> outlined;
+  std::map<std::string, uint64_t> redacted; // --redact: secrets replaced, by rule
+  int redactedFiles = 0;
+
+  MergeStats &operator+=(const MergeStats &other) {
+    mergedFiles += other.mergedFiles;
+    skippedFilesNonCode += other.skippedFilesNonCode;
+    skippedFilesIgnored += other.skippedFilesIgnored;
+    skippedDirs += other.skippedDirs;
+    sameAsFiles += other.sameAsFiles;
+    sameAsDirs += other.sameAsDirs;
+    symlinkCycles += other.symlinkCycles;
+    filteredFiles += other.filteredFiles;
+    filteredDirs += other.filteredDirs;
+    outputBytes += other.outputBytes;
+    elapsed += other.elapsed;
+    for (const auto &[language, metrics]: other.languages) {
+      languages[language] += metrics;
+    }
+    for (const auto &[language, counts]: other.minified) {
+      minified[language] += counts;
+    }
+    for (const auto &[language, counts]: other.outlined) {
+      outlined[language] += counts;
+    }
+    for (const auto &[rule, count]: other.redacted) {
+      redacted[rule] += count;
+    }
+    redactedFiles += other.redactedFiles;
+    return *this;
+  }
+};
+
+// --- 回调输出 (mergeToSink) ---
+
+// Metadata of a file passed to MergeSink, as the XML output would describe it.
+struct MergedFile {
+  // Path of the file: on disk for directory walks, under the directory the
+  // archive would be extracted to for archives, under the root for --rev.
+  std::filesystem::path path;
+  uint64_t size = 0; // size from metadata (sizeKnown)
+  bool sizeKnown = false;
+  // Content is the first and last lines only (--max-file-bytes / -lines).
+  bool excerpted = false;
+  // Content is the declarations only (--outline).
+  bool outlined = false;
+  // --near-dup collapse: content is a unified diff against nearDuplicateOf.
+  std::filesystem::path nearDuplicateOf;
+  double similarity = 0;
+  // --follow-symlinks: root-relative path of the same physical file, already
+  // delivered; no content.
+  std::string sameAs;
+  // XXH3-64 of the file's content (--hash), also for excerpts and diffs.
+  uint64_t hash = 0;
+  // Secrets replaced in the content (--redact).
+  size_t redactions = 0;
+};
+
+/**
+ * @brief Receiver of the files of mergeToSink, called on the calling thread in
+ *        output order. Content views are only valid during the call.
+ */
+class MergeSink {
+  public:
+  virtual ~MergeSink() = default;
+
+  // Around the files of each root, as the XML output's <project> element.
+  virtual void beginRoot(const std::filesystem::path &) {}
+  virtual void endRoot(const std::filesystem::path &, const MergeStats &) {}
+
+  // One merged file with its whole content (BOM removed).
+  virtual void file(const MergedFile &merged, std::string_view content) = 0;
+
+  // A file above MergeOptions::streamThreshold, delivered in chunks: each
+  // chunk with last false, then an empty one with last true (merged.hash is
+  // set then). By default the chunks are collected and passed to file().
+  virtual void fileChunk(const MergedFile &merged, std::string_view chunk, bool last) {
+    pending.append(chunk);
+    if (last) {
+      file(merged, pending);
+      pending.clear();
+    }
+  }
+
+  // Console output of the merge (progress and warnings, as the command line
+  // tool prints them), passed on when mergeToSink returns. The library never
+  // touches std::cout / std::cerr meanwhile: the host, its other threads and
+  // concurrent mergeToSink calls print and capture independently.
+  virtual void message(bool /*error*/, std::string_view /*text*/) {}
+
+  private:
+  std::string pending;
+};
+
+// --- 输入 ---
+
+enum class ArchiveKind { None, Zip, Tar, TarGz };
+
+// Archive format by file name (.zip, .tar, .tar.gz / .tgz), None otherwise.
+ArchiveKind archiveKindOf(const std::filesystem::path &path);
+// Directory the archive would be extracted to ("src.tar.gz" -> "src").
+std::filesystem::path archiveExtractRoot(const std::filesystem::path &archive);
+
+// --- 入口 ---
+
+/**
+ * @brief Merges the roots (directories or archives) into one XML file.
+ * @return 0 on success, 1 on error (reported on std::cerr).
+ */
+int mergeByDir(const std::vector<std::filesystem::path> &rootPaths,
+               const std::filesystem::path &outputFile, const MergeOptions &options);
+
+/**
+ * @brief Merges the files listed in a reference file into <stem>_merge.xml
+ *        next to it.
+ * @return 0 on success, 1 on error (reported on std::cerr).
+ */
+int mergeByRef(const std::filesystem::path &refFilePath, const MergeOptions &options);
+
+/**
+ * @brief Merges the roots like mergeByDir, passing the files to sink instead
+ *        of writing XML. Roots are processed one after another; --diff and
+ *        --progress do not apply.
+ * @param stats Receives the counters of all roots.
+ */
+void mergeToSink(const std::vector<std::filesystem::path> &rootPaths, MergeSink &sink,
+                 const MergeOptions &options, MergeStats &stats);
+
+// Runs the jobs of a --batch manifest; 0 if all of them succeeded.
+int runBatch(const std::filesystem::path &manifestPath, const MergeOptions &options);
+
+// Compares std::ofstream with the OutputSink modes on a scratch file.
+int runOutputBenchmark(const std::filesystem::path &benchFile);
+
+/**
+ * @brief Parses a byte size such as "4096", "200k", "64M" or "1g".
+ * @return false if the text is not a valid size.
+ */
+bool parseByteSize(const std::string &text, uint64_t &bytes);
+
+/**
+ * @brief Splits a command line into options ("--name value" or
+ *        "--name=value"), applied to options, and positional arguments.
+ * @param args Receives argv[0] followed by the positional arguments.
+ * @return false with a message in error if an option is unknown or invalid.
+ */
+bool parseCommandLine(int argc, char *argv[], MergeOptions &options,
+                      std::vector<std::string> &args, std::string &error);
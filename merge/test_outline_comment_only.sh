@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# Test script for --outline on files that are only comments (directory mode):
+# such a file outlines to nothing but was read fine, so it must still be
+# written as a <file> element and not be reported as a read failure.
+
+# Path to the merge executable
+MERGE_EXECUTABLE="${MERGE_EXECUTABLE:-../cmake-build-release/merge}"
+
+# Check if merge executable exists
+if [ ! -f "$MERGE_EXECUTABLE" ]; then
+    echo "Error: $MERGE_EXECUTABLE not found!"
+    echo "Please build merge or set MERGE_EXECUTABLE to its path."
+    exit 1
+fi
+
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+mkdir -p "$WORK_DIR/proj"
+printf '# Copyright (c) Example\n# Licensed under the MIT License.\n' > "$WORK_DIR/proj/license_header.py"
+printf '/*\n * Only a comment.\n */\n// and another one\n' > "$WORK_DIR/proj/comments.c"
+printf 'int add(int a, int b) {\n  return a + b;\n}\n' > "$WORK_DIR/proj/add.c"
+
+OUTPUT="$WORK_DIR/out.xml"
+LOG="$("$MERGE_EXECUTABLE" --outline "$WORK_DIR/proj" "$OUTPUT" 2>&1)"
+
+failed=0
+for name in license_header.py comments.c add.c; do
+    if ! grep -q "<file name=\"$name\"" "$OUTPUT"; then
+        echo "FAIL: $name missing from the output"
+        failed=1
+    fi
+done
+if echo "$LOG" | grep -q "读取内容为空或失败"; then
+    echo "FAIL: a comment-only file was reported as a read failure"
+    failed=1
+fi
+
+if [ "$failed" -ne 0 ]; then
+    echo "$LOG"
+    exit 1
+fi
+echo "=== Test completed ==="